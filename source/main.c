@@ -25,7 +25,7 @@
  */
 
 #define _POSIX_SOURCE 1
-#define _POSIX_C_SOURCE 200112L
+#define _POSIX_C_SOURCE 200809L
 #define AUTHOR "Johnathan McKnight <akoimeexx@gmail.com>"
 #define VERSION "0.0.2"
 
@@ -37,16 +37,30 @@
 #include <unistd.h>
 /* Directory access */
 #include <dirent.h>
+/* File descriptor access: open, openat, O_* flags */
+#include <fcntl.h>
+/* File status: fstatat, mkdir, futimens */
+#include <sys/stat.h>
+/* Device control, used for FICLONE reflinks */
+#include <sys/ioctl.h>
+/* Process control: waitpid, for log workers and gzip */
+#include <sys/wait.h>
+/* Waiting on several log workers at once */
+#include <poll.h>
 /* Error reporting */ //INFO: <asm-generic/errno.h>: good human-readable strings
 #include <errno.h>
 /* String manipulation: strncmp, strncpy */
 #include <string.h>
+/* Log timestamps: time_t, localtime_r, strftime */
+#include <time.h>
 /* Command line option parsing made easy */
 #include <getopt.h>
 /* Extended exit codes for more verbose exit conditions */
 #include <sysexits.h>
 /* Linux OS defines describing FS limitations, etc */
 #include <linux/limits.h>
+/* Linux filesystem ioctls, FICLONE */
+#include <linux/fs.h>
 
 
 /* Static string constants that generally won't be changed. */
@@ -59,22 +73,44 @@ static const char *extended_help =
 "                              adds an entry to to /etc/hosts as if\n"
 "                              apache2-vhost --link <vhostdomain> was called\n"
 "  -h, --help                  Outputs this help text\n"
+"  -i, --park-idle <days>      With --analyze-traffic, moves the symlinks of\n"
+"                              vhosts without requests for <days> days from\n"
+"                              HTTPD_ROOT/sites-enabled/ to\n"
+"                              HTTPD_ROOT/sites-parked/\n"
 "  -l, --list                  Lists all files with the file extension\n"
 "                              *%s in HTTPD_ROOT/sites-available/\n"
+"  -o, --order-includes        With --analyze-traffic, writes\n"
+"                              HTTPD_ROOT/apache2-vhost.traffic.conf including\n"
+"                              the other sites, then the enabled vhosts busiest\n"
+"                              first\n"
 "  -p, --purge <vhostdomain>   Removes the associated <vhostdomain> file from\n"
 "                              HTTPD_ROOT/sites-available/; then removes the\n"
 "                              associated link from HTTPD_ROOT/sites-enabled/ and\n"
 "                              entry from /etc/hosts as if\n"
 "                              apache2-vhost --remove <vhostdomain> was called\n"
+"  -R, --rollback <snapshot>   Restores the vhost state saved by --snapshot,\n"
+"                              touching only the files, symbolic links and\n"
+"                              /etc/hosts entries that differ from <snapshot>\n"
 "  -r, --remove <vhostdomain>  Removes the associated <vhostdomain> file from\n"
-"                              HTTPD_ROOT/sites-enabled/ and entry from\n"
-"                              /etc/hosts\n"
+"                              HTTPD_ROOT/sites-enabled/ (or sites-parked/) and\n"
+"                              entry from /etc/hosts\n"
 "  -s, --link <vhostdomain>    Symlinks the associated <vhostdomain> file from\n"
 "                              HTTPD_ROOT/sites-available/ to\n"
 "                              HTTPD_ROOT/sites-enabled/ and adds an entry to\n"
 "                              /etc/hosts\n"
+"  -S, --snapshot <snapshot>   Saves the *%s files in\n"
+"                              HTTPD_ROOT/sites-available/, the symbolic links in\n"
+"                              HTTPD_ROOT/sites-enabled/ and sites-parked/ and\n"
+"                              their /etc/hosts entries to the new directory\n"
+"                              <snapshot>\n"
+"  -t, --analyze-traffic <log> [<log>...]\n"
+"                              Counts the requests per vhost in vhost_combined\n"
+"                              access logs, gzipped or not, and lists the vhosts\n"
+"                              busiest first\n"
+"  -u, --unpark <vhostdomain>  Moves the symlink of <vhostdomain> parked by\n"
+"                              --park-idle back to HTTPD_ROOT/sites-enabled/\n"
 "  -v, --version               Print the version number and exit\n";
-static const char *usage = "Usage: apache2-vhost -[aprs] <vhostdomain>, apache2-vhost -[hlv]\n";
+static const char *usage = "Usage: apache2-vhost -[aprsu] <vhostdomain>, apache2-vhost -[RS] <snapshot>, apache2-vhost -[io] -t <log>..., apache2-vhost -[hlv]\n";
 static const char *v_info = "apache2-vhost: Apache2 vhost configuration manager v%s by %s\n";
 static const char *vhost_template = 
 "<VirtualHost *:80>\n"
@@ -94,14 +130,24 @@ static const char *vhost_template =
 static char file_extension[NAME_MAX] = ".vhost.conf"; // 255
 static char httpd_root[PATH_MAX] = "/etc/apache2"; // 4096
 
+/* Names used next to managed files by --snapshot and --rollback */
+static const char *latest_name = ".apache2-vhost.latest";
+static const char *rollback_name = ".apache2-vhost.rollback";
+
 /* Command line long option list for use with getopt_long */
 static struct option long_opts[] = {
 	{"add", required_argument, 0, 'a'}, 
+	{"analyze-traffic", required_argument, 0, 't'}, 
 	{"help", no_argument, 0, 'h'}, 
 	{"link", required_argument, 0, 's'}, 
 	{"list", no_argument, 0, 'l'}, 
+	{"order-includes", no_argument, 0, 'o'}, 
+	{"park-idle", required_argument, 0, 'i'}, 
 	{"purge", required_argument, 0, 'p'}, 
 	{"remove", required_argument, 0, 'r'}, 
+	{"rollback", required_argument, 0, 'R'}, 
+	{"snapshot", required_argument, 0, 'S'}, 
+	{"unpark", required_argument, 0, 'u'}, 
 	{"version", no_argument, 0, 'v'}, 
 	/**
 	 * Magic numbers to denote array termination. Reference: 
@@ -133,6 +179,1328 @@ int strncmp_r(const char *s1, const char *s2, int n) {
 	return strcmp(sub1, sub2);
 }
 
+/**
+ * has_extension - Check whether name ends with extension and has a prefix
+ */
+int has_extension(const char *name, const char *extension) {
+	size_t name_len = strlen(name);
+	size_t ext_len = strlen(extension);
+	return name_len > ext_len && strcmp(&name[name_len - ext_len], extension) == 0;
+}
+
+/**
+ * Sorted list of vhost file names, with an optional symbolic link target and
+ * the lstat taken while reading the directory, used to compare a snapshot
+ * against the live tree without re-scanning or re-statting it.
+ */
+struct vhost_entry {
+	char *name;
+	char *target;
+	struct stat st;
+};
+struct vhost_list {
+	struct vhost_entry *entries;
+	size_t count;
+	size_t size;
+};
+
+/**
+ * vhost_list_add - Append a copy of name (and target and st, if any) to list
+ */
+void vhost_list_add(struct vhost_list *list, const char *name, const char *target, const struct stat *st) {
+	if(list->count == list->size) {
+		list->size = list->size ? list->size * 2 : 256;
+		list->entries = realloc(list->entries, list->size * sizeof *list->entries);
+		if(list->entries == NULL) {
+			fprintf(stderr, "apache2-vhost: out of memory: %s\n", strerror(errno));
+			exit(EX_OSERR); // Exit 71
+		}
+	}
+	struct vhost_entry *entry = &list->entries[list->count++];
+	entry->name = strdup(name);
+	entry->target = target ? strdup(target) : NULL;
+	if(st) {
+		entry->st = *st;
+	} else {
+		memset(&entry->st, 0, sizeof entry->st);
+	}
+	if(entry->name == NULL || (target && entry->target == NULL)) {
+		fprintf(stderr, "apache2-vhost: out of memory: %s\n", strerror(errno));
+		exit(EX_OSERR); // Exit 71
+	}
+}
+
+/**
+ * vhost_entry_cmp - qsort/bsearch comparison of two entries by name
+ */
+int vhost_entry_cmp(const void *a, const void *b) {
+	return strcmp(((const struct vhost_entry *)a)->name, ((const struct vhost_entry *)b)->name);
+}
+
+/**
+ * vhost_list_find - Binary search a sorted list for name
+ */
+struct vhost_entry *vhost_list_find(const struct vhost_list *list, const char *name) {
+	struct vhost_entry key;
+	key.name = (char *)name;
+	if(list->count == 0) {
+		return NULL;
+	}
+	return bsearch(&key, list->entries, list->count, sizeof *list->entries, vhost_entry_cmp);
+}
+
+/**
+ * vhost_list_find_host - Find the entry for the vhost file serving host
+ */
+struct vhost_entry *vhost_list_find_host(const struct vhost_list *list, const char *host, size_t host_len) {
+	char vhost_name[NAME_MAX + 1];
+	int vhost_fnlen = snprintf(vhost_name, sizeof vhost_name, "%.*s%s", (int)host_len, host, file_extension);
+	if(vhost_fnlen < 0 || vhost_fnlen > NAME_MAX) {
+		return NULL;
+	}
+	return vhost_list_find(list, vhost_name);
+}
+
+/**
+ * httpd_path - Put together HTTPD_ROOT/subdir in path, or exit if too long
+ */
+void httpd_path(char path[PATH_MAX], const char *subdir) {
+	int path_len = snprintf(path, PATH_MAX, "%.*s/%s", PATH_MAX - 1, httpd_root, subdir);
+	// Check to make sure the path is not too long
+	if(path_len == -1 || path_len >= PATH_MAX) {
+		fprintf(stderr, "apache2-vhost: file path `%s' too long: %s\n", path, strerror(errno));
+		exit(EX_SOFTWARE); // Exit 70
+	}
+}
+
+/**
+ * open_directory - Open path as a directory file descriptor, or exit
+ */
+int open_directory(int dirfd, const char *path) {
+	int fd = openat(dirfd, path, O_RDONLY | O_DIRECTORY);
+	if(fd == -1) {
+		fprintf(stderr, "apache2-vhost: cannot open directory `%s': %s\n", path, strerror(errno));
+		exit(EX_SOFTWARE); // Exit 70
+	}
+	return fd;
+}
+
+/**
+ * read_vhosts - Collect the *file_extension entries of dirfd into a sorted
+ * list; regular files only, or symbolic links and their targets if links is set
+ */
+void read_vhosts(int dirfd, const char *path, int links, struct vhost_list *list) {
+	DIR *dir = fdopendir(dup(dirfd));
+	if(dir == NULL) {
+		fprintf(stderr, "apache2-vhost: cannot open directory `%s': %s\n", path, strerror(errno));
+		exit(EX_SOFTWARE); // Exit 70
+	}
+	// The duplicate shares its offset with dirfd, which may have been read
+	rewinddir(dir);
+	struct dirent *ent;
+	while((ent = readdir(dir)) != NULL) {
+		if(!has_extension(ent->d_name, file_extension)) {
+			continue;
+		}
+		struct stat st;
+		if(fstatat(dirfd, ent->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+			continue;
+		}
+		if(links && S_ISLNK(st.st_mode)) {
+			char target[PATH_MAX];
+			ssize_t target_len = readlinkat(dirfd, ent->d_name, target, sizeof target - 1);
+			if(target_len == -1) {
+				fprintf(stderr, "apache2-vhost: cannot read symbolic link `%s/%s': %s\n", path, ent->d_name, strerror(errno));
+				exit(EX_SOFTWARE); // Exit 70
+			}
+			target[target_len] = '\0';
+			vhost_list_add(list, ent->d_name, target, &st);
+		} else if(!links && S_ISREG(st.st_mode)) {
+			vhost_list_add(list, ent->d_name, NULL, &st);
+		}
+	}
+	closedir(dir);
+	qsort(list->entries, list->count, sizeof *list->entries, vhost_entry_cmp);
+}
+
+/**
+ * hosts_entry - Return the host name of a line written by --link, that is
+ * "127.0.0.1\t<vhostdomain>", or NULL for any other line
+ */
+const char *hosts_entry(const char *line, size_t line_len, size_t *host_len) {
+	static const char prefix[] = "127.0.0.1\t";
+	size_t prefix_len = sizeof prefix - 1;
+	if(line_len <= prefix_len || strncmp(line, prefix, prefix_len) != 0) {
+		return NULL;
+	}
+	const char *host = &line[prefix_len];
+	size_t len = line_len - prefix_len;
+	for(size_t i = 0; i < len; i++) {
+		if(host[i] == ' ' || host[i] == '\t' || host[i] == '#') {
+			return NULL;
+		}
+	}
+	*host_len = len;
+	return host;
+}
+
+/**
+ * read_file - Read the whole of path into a NUL-terminated buffer
+ */
+char *read_file(int dirfd, const char *path, size_t *len) {
+	int fd = openat(dirfd, path, O_RDONLY);
+	if(fd == -1) {
+		return NULL;
+	}
+	size_t size = 4096;
+	char *buf = malloc(size);
+	*len = 0;
+	ssize_t n;
+	while(buf != NULL) {
+		if(*len + 1 == size) {
+			size *= 2;
+			char *grown = realloc(buf, size);
+			if(grown == NULL) {
+				free(buf);
+				buf = NULL;
+				break;
+			}
+			buf = grown;
+		}
+		n = read(fd, &buf[*len], size - *len - 1);
+		if(n <= 0) {
+			if(n == -1) {
+				free(buf);
+				buf = NULL;
+			}
+			break;
+		}
+		*len += n;
+	}
+	close(fd);
+	if(buf != NULL) {
+		buf[*len] = '\0';
+	}
+	return buf;
+}
+
+/**
+ * clone_file - Copy src_name to the new file dst_name, as a reflink where the
+ * filesystem supports it. The modification time is carried over so later
+ * comparisons can skip the file.
+ */
+int clone_file(int src_dirfd, const char *src_name, int dst_dirfd, const char *dst_name) {
+	int src = openat(src_dirfd, src_name, O_RDONLY);
+	if(src == -1) {
+		return -1;
+	}
+	struct stat st;
+	if(fstat(src, &st) == -1) {
+		close(src);
+		return -1;
+	}
+	int dst = openat(dst_dirfd, dst_name, O_WRONLY | O_CREAT | O_EXCL, st.st_mode & 07777);
+	if(dst == -1) {
+		close(src);
+		return -1;
+	}
+	int cloned = -1;
+#ifdef FICLONE
+	cloned = ioctl(dst, FICLONE, src);
+#endif
+	if(cloned == -1) {
+		// No reflink support here, fall back to a plain copy
+		char buf[65536];
+		ssize_t n;
+		while((n = read(src, buf, sizeof buf)) > 0) {
+			if(write(dst, buf, n) != n) {
+				n = -1;
+				break;
+			}
+		}
+		if(n == -1) {
+			close(src);
+			close(dst);
+			unlinkat(dst_dirfd, dst_name, 0);
+			return -1;
+		}
+	}
+	struct timespec times[2] = {st.st_atim, st.st_mtim};
+	futimens(dst, times);
+	close(src);
+	return close(dst);
+}
+
+/**
+ * same_file - Check whether two stats look like the same file contents, using
+ * the size and modification time as rsync does by default
+ */
+int same_file(const struct stat *a, const struct stat *b) {
+	return a->st_size == b->st_size && 
+			a->st_mtim.tv_sec == b->st_mtim.tv_sec && 
+			a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+/**
+ * trusted_stat - Check that a file is owned by us and not writable by group or
+ * others, so nobody else can change it once it is linked into a snapshot
+ */
+int trusted_stat(const struct stat *st) {
+	return st->st_uid == geteuid() && (st->st_mode & (S_IWGRP | S_IWOTH)) == 0;
+}
+
+/**
+ * other_site - scandir filter for the *.conf files of sites-enabled/ that
+ * apache2-vhost does not manage, such as 000-default.conf
+ */
+int other_site(const struct dirent *ent) {
+	return ent->d_name[0] != '.' && has_extension(ent->d_name, ".conf") && 
+			!has_extension(ent->d_name, file_extension);
+}
+
+/**
+ * write_traffic_conf - Replace HTTPD_ROOT/apache2-vhost.traffic.conf with conf
+ */
+void write_traffic_conf(const char *conf, size_t conf_len) {
+	char order_path[PATH_MAX]; // 4096
+	char order_temppath[PATH_MAX]; // 4096
+	httpd_path(order_path, "apache2-vhost.traffic.conf");
+	httpd_path(order_temppath, "apache2-vhost.traffic.conf.tmp");
+	FILE *order_file = fopen(order_temppath, "w");
+	if(order_file == NULL) {
+		fprintf(stderr, "apache2-vhost: cannot create regular file `%s': %s\n", order_temppath, strerror(errno));
+		exit(EX_CANTCREAT); // Exit 73
+	}
+	fwrite(conf, 1, conf_len, order_file);
+	if(fclose(order_file) != 0 || rename(order_temppath, order_path) == -1) {
+		fprintf(stderr, "apache2-vhost: cannot write regular file `%s': %s\n", order_path, strerror(errno));
+		unlink(order_temppath);
+		exit(EX_IOERR); // Exit 74
+	}
+}
+
+/**
+ * refresh_traffic_conf - If --order-includes wrote
+ * HTTPD_ROOT/apache2-vhost.traffic.conf, drop its includes of vhosts no longer
+ * in sites-enabled/ and append the ones newly there, keeping the order of the
+ * rest. Called by everything that links, unlinks or parks a vhost.
+ */
+void refresh_traffic_conf(void) {
+	char order_path[PATH_MAX]; // 4096
+	char enabled_path[PATH_MAX]; // 4096
+	httpd_path(order_path, "apache2-vhost.traffic.conf");
+	httpd_path(enabled_path, "sites-enabled");
+	size_t old_len;
+	char *old = read_file(AT_FDCWD, order_path, &old_len);
+	if(old == NULL) {
+		return;
+	}
+	int enabled_fd = open_directory(AT_FDCWD, enabled_path);
+	struct vhost_list enabled = {0};
+	read_vhosts(enabled_fd, enabled_path, 1, &enabled);
+	close(enabled_fd);
+	char *listed = calloc(enabled.count + 1, 1);
+	char *conf = NULL;
+	size_t conf_len = 0;
+	FILE *conf_stream = open_memstream(&conf, &conf_len);
+	if(listed == NULL || conf_stream == NULL) {
+		fprintf(stderr, "apache2-vhost: out of memory: %s\n", strerror(errno));
+		exit(EX_OSERR); // Exit 71
+	}
+	char prefix[PATH_MAX + 16];
+	int prefix_len = snprintf(prefix, sizeof prefix, "Include %s/", enabled_path);
+	for(char *line = old; line < &old[old_len];) {
+		char *line_end = strchr(line, '\n');
+		size_t line_len = line_end ? (size_t)(line_end - line) : strlen(line);
+		size_t name_len = line_len - prefix_len;
+		if(line_len > (size_t)prefix_len && name_len <= NAME_MAX && strncmp(line, prefix, prefix_len) == 0) {
+			char name[NAME_MAX + 1];
+			memcpy(name, &line[prefix_len], name_len);
+			name[name_len] = '\0';
+			if(has_extension(name, file_extension)) {
+				struct vhost_entry *entry = vhost_list_find(&enabled, name);
+				if(entry == NULL || listed[entry - enabled.entries]) {
+					line += line_len + 1;
+					continue;
+				}
+				listed[entry - enabled.entries] = 1;
+			}
+		}
+		fprintf(conf_stream, "%.*s\n", (int)line_len, line);
+		line += line_len + 1;
+	}
+	for(size_t i = 0; i < enabled.count; i++) {
+		if(!listed[i]) {
+			fprintf(conf_stream, "Include %s/%s\n", enabled_path, enabled.entries[i].name);
+		}
+	}
+	fclose(conf_stream);
+	if(conf_len != old_len || memcmp(conf, old, conf_len) != 0) {
+		write_traffic_conf(conf, conf_len);
+	}
+	free(conf);
+	free(listed);
+	free(old);
+}
+
+/**
+ * save_links - Write the *file_extension symbolic links of links_fd (none if
+ * it is -1) to the manifest manifest_name in the snapshot, one
+ * "<name>\t<target>" per line
+ */
+void save_links(int snapshot_fd, const char *snapshot_path, const char *manifest_name, int links_fd, const char *links_path) {
+	struct vhost_list links = {0};
+	if(links_fd != -1) {
+		read_vhosts(links_fd, links_path, 1, &links);
+	}
+	int manifest_fd = openat(snapshot_fd, manifest_name, O_WRONLY | O_CREAT | O_EXCL, 0600);
+	FILE *manifest = manifest_fd == -1 ? NULL : fdopen(manifest_fd, "w");
+	if(manifest == NULL) {
+		fprintf(stderr, "apache2-vhost: cannot create regular file `%s/%s': %s\n", snapshot_path, manifest_name, strerror(errno));
+		exit(EX_CANTCREAT); // Exit 73
+	}
+	for(size_t i = 0; i < links.count; i++) {
+		if(strpbrk(links.entries[i].name, "\t\n") || strchr(links.entries[i].target, '\n')) {
+			fprintf(stderr, "apache2-vhost: skipping symbolic link `%s/%s': unsupported name\n", links_path, links.entries[i].name);
+			continue;
+		}
+		fprintf(manifest, "%s\t%s\n", links.entries[i].name, links.entries[i].target);
+	}
+	if(fclose(manifest) != 0) {
+		fprintf(stderr, "apache2-vhost: cannot write regular file `%s/%s': %s\n", snapshot_path, manifest_name, strerror(errno));
+		exit(EX_IOERR); // Exit 74
+	}
+}
+
+/**
+ * load_links - Read the manifest manifest_name written by save_links into a
+ * sorted list. Returns -1 if the snapshot has no such manifest.
+ */
+int load_links(int snapshot_fd, const char *snapshot_path, const char *manifest_name, struct vhost_list *links) {
+	size_t manifest_len;
+	char *manifest = read_file(snapshot_fd, manifest_name, &manifest_len);
+	if(manifest == NULL && errno == ENOENT) {
+		return -1;
+	}
+	if(manifest == NULL) {
+		fprintf(stderr, "apache2-vhost: cannot read snapshot `%s': %s\n", snapshot_path, strerror(errno));
+		exit(EX_DATAERR); // Exit 65
+	}
+	for(char *line = manifest; *line;) {
+		char *line_end = strchr(line, '\n');
+		char *tab = strchr(line, '\t');
+		if(line_end == NULL || tab == NULL || tab > line_end) {
+			fprintf(stderr, "apache2-vhost: cannot read snapshot `%s': malformed %s\n", snapshot_path, manifest_name);
+			exit(EX_DATAERR); // Exit 65
+		}
+		*tab = '\0';
+		*line_end = '\0';
+		vhost_list_add(links, line, tab + 1, NULL);
+		line = line_end + 1;
+	}
+	qsort(links->entries, links->count, sizeof *links->entries, vhost_entry_cmp);
+	free(manifest);
+	return 0;
+}
+
+/**
+ * restore_links - Make the *file_extension symbolic links of links_fd match
+ * saved_links: drop new ones, re-point or recreate changed ones
+ */
+void restore_links(int links_fd, const char *links_path, const struct vhost_list *saved_links) {
+	struct vhost_list links = {0};
+	read_vhosts(links_fd, links_path, 1, &links);
+	for(size_t i = 0; i < links.count; i++) {
+		if(vhost_list_find(saved_links, links.entries[i].name) == NULL && unlinkat(links_fd, links.entries[i].name, 0) == -1) {
+			fprintf(stderr, "apache2-vhost: failed to remove symbolic link `%s/%s': %s\n", links_path, links.entries[i].name, strerror(errno));
+			exit(EX_SOFTWARE); // Exit 70
+		}
+	}
+	for(size_t i = 0; i < saved_links->count; i++) {
+		const struct vhost_entry *link = &saved_links->entries[i];
+		const struct vhost_entry *current = vhost_list_find(&links, link->name);
+		if(current && strcmp(current->target, link->target) == 0) {
+			continue;
+		}
+		unlinkat(links_fd, rollback_name, 0);
+		if(symlinkat(link->target, links_fd, rollback_name) == -1 || renameat(links_fd, rollback_name, links_fd, link->name) == -1) {
+			fprintf(stderr, "apache2-vhost: failed to create symbolic link `%s/%s': %s\n", links_path, link->name, strerror(errno));
+			exit(EX_SOFTWARE); // Exit 70
+		}
+	}
+}
+
+/**
+ * snapshot_vhosts - Save the managed vhost state to the new directory
+ * snapshot_path: sites-available/ holds copies of the *file_extension files,
+ * sites-enabled and sites-parked list their symbolic links (see save_links),
+ * and hosts holds the /etc/hosts entries belonging to those vhosts.
+ * 
+ * Files unchanged since the previous snapshot in the same parent directory
+ * (found through its latest_name symbolic link) are hard linked to it, the
+ * rest are reflinked or copied; snapshot files are never shared with the live
+ * tree, so editing a vhost in place cannot alter a snapshot. The previous
+ * snapshot is only linked against if it is private to us (see trusted_stat),
+ * as the parent may be shared, /tmp say.
+ */
+void snapshot_vhosts(const char *snapshot_path) {
+	char available_path[PATH_MAX]; // 4096
+	char enabled_path[PATH_MAX]; // 4096
+	httpd_path(available_path, "sites-available");
+	httpd_path(enabled_path, "sites-enabled");
+	int available_fd = open_directory(AT_FDCWD, available_path);
+	int enabled_fd = open_directory(AT_FDCWD, enabled_path);
+	
+	if(mkdir(snapshot_path, 0700) == -1) {
+		fprintf(stderr, "apache2-vhost: cannot create directory `%s': %s\n", snapshot_path, strerror(errno));
+		exit(EX_CANTCREAT); // Exit 73
+	}
+	int snapshot_fd = open_directory(AT_FDCWD, snapshot_path);
+	if(mkdirat(snapshot_fd, "sites-available", 0700) == -1) {
+		fprintf(stderr, "apache2-vhost: cannot create directory `%s/sites-available': %s\n", snapshot_path, strerror(errno));
+		exit(EX_CANTCREAT); // Exit 73
+	}
+	int saved_fd = open_directory(snapshot_fd, "sites-available");
+	
+	// Split snapshot_path into its parent directory and its own name
+	char parent_path[PATH_MAX]; // 4096
+	char snapshot_name[PATH_MAX]; // 4096
+	strncpy(parent_path, snapshot_path, sizeof parent_path - 1);
+	parent_path[sizeof parent_path - 1] = '\0';
+	size_t parent_len = strlen(parent_path);
+	while(parent_len > 1 && parent_path[parent_len - 1] == '/') {
+		parent_path[--parent_len] = '\0';
+	}
+	char *name_start = strrchr(parent_path, '/');
+	strcpy(snapshot_name, name_start ? name_start + 1 : parent_path);
+	if(name_start == NULL) {
+		strcpy(parent_path, ".");
+	} else if(name_start == parent_path) {
+		strcpy(parent_path, "/");
+	} else {
+		*name_start = '\0';
+	}
+	int parent_fd = open_directory(AT_FDCWD, parent_path);
+	int previous_fd = -1;
+	struct stat latest_st;
+	if(fstatat(parent_fd, latest_name, &latest_st, AT_SYMLINK_NOFOLLOW) == 0 && 
+			S_ISLNK(latest_st.st_mode) && latest_st.st_uid == geteuid()) {
+		// Checked through the opened descriptors, so they cannot be swapped
+		int latest_fd = openat(parent_fd, latest_name, O_RDONLY | O_DIRECTORY);
+		struct stat previous_st;
+		if(latest_fd != -1 && fstat(latest_fd, &previous_st) == 0 && trusted_stat(&previous_st)) {
+			previous_fd = openat(latest_fd, "sites-available", O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+			if(previous_fd != -1 && (fstat(previous_fd, &previous_st) == -1 || !trusted_stat(&previous_st))) {
+				close(previous_fd);
+				previous_fd = -1;
+			}
+		}
+		if(latest_fd != -1) {
+			close(latest_fd);
+		}
+	}
+	
+	// Configuration files: hard linked to the previous snapshot if unchanged
+	struct vhost_list available = {0};
+	read_vhosts(available_fd, available_path, 0, &available);
+	for(size_t i = 0; i < available.count; i++) {
+		const char *name = available.entries[i].name;
+		struct stat previous_st;
+		if(previous_fd != -1 && fstatat(previous_fd, name, &previous_st, AT_SYMLINK_NOFOLLOW) == 0 && 
+				S_ISREG(previous_st.st_mode) && trusted_stat(&previous_st) && 
+				S_ISREG(available.entries[i].st.st_mode) && same_file(&previous_st, &available.entries[i].st) && 
+				linkat(previous_fd, name, saved_fd, name, 0) == 0) {
+			continue;
+		}
+		if(clone_file(available_fd, name, saved_fd, name) == -1) {
+			fprintf(stderr, "apache2-vhost: cannot save regular file `%s/%s': %s\n", available_path, name, strerror(errno));
+			exit(EX_CANTCREAT); // Exit 73
+		}
+	}
+	
+	// Symbolic links, enabled and parked: recorded by target in manifests
+	save_links(snapshot_fd, snapshot_path, "sites-enabled", enabled_fd, enabled_path);
+	char parked_path[PATH_MAX]; // 4096
+	httpd_path(parked_path, "sites-parked");
+	int parked_fd = openat(AT_FDCWD, parked_path, O_RDONLY | O_DIRECTORY);
+	save_links(snapshot_fd, snapshot_path, "sites-parked", parked_fd, parked_path);
+	if(parked_fd != -1) {
+		close(parked_fd);
+	}
+	
+	// Hosts entries: only the lines --link wrote for a saved vhost
+	size_t hosts_len;
+	char *hosts = read_file(AT_FDCWD, "/etc/hosts", &hosts_len);
+	if(hosts == NULL) {
+		fprintf(stderr, "apache2-vhost: cannot open regular file `%s' for reading: %s\n", "/etc/hosts", strerror(errno));
+		exit(EX_SOFTWARE); // Exit 70
+	}
+	int saved_hosts_fd = openat(snapshot_fd, "hosts", O_WRONLY | O_CREAT | O_EXCL, 0600);
+	FILE *saved_hosts = saved_hosts_fd == -1 ? NULL : fdopen(saved_hosts_fd, "w");
+	if(saved_hosts == NULL) {
+		fprintf(stderr, "apache2-vhost: cannot create regular file `%s/hosts': %s\n", snapshot_path, strerror(errno));
+		exit(EX_CANTCREAT); // Exit 73
+	}
+	for(char *line = hosts; line < &hosts[hosts_len];) {
+		char *line_end = strchr(line, '\n');
+		size_t line_len = line_end ? (size_t)(line_end - line) : strlen(line);
+		size_t host_len;
+		const char *host = hosts_entry(line, line_len, &host_len);
+		if(host && vhost_list_find_host(&available, host, host_len)) {
+			fprintf(saved_hosts, "%.*s\n", (int)line_len, line);
+		}
+		line += line_len + 1;
+	}
+	if(fclose(saved_hosts) != 0) {
+		fprintf(stderr, "apache2-vhost: cannot write regular file `%s/hosts': %s\n", snapshot_path, strerror(errno));
+		exit(EX_IOERR); // Exit 74
+	}
+	free(hosts);
+	
+	// Point latest_name at this snapshot for the next one to link against
+	unlinkat(parent_fd, rollback_name, 0);
+	if(symlinkat(snapshot_name, parent_fd, rollback_name) == -1 || renameat(parent_fd, rollback_name, parent_fd, latest_name) == -1) {
+		fprintf(stderr, "apache2-vhost: failed to create symbolic link `%s/%s': %s\n", parent_path, latest_name, strerror(errno));
+		exit(EX_SOFTWARE); // Exit 70
+	}
+	
+	if(previous_fd != -1) {
+		close(previous_fd);
+	}
+	close(parent_fd);
+	close(saved_fd);
+	close(snapshot_fd);
+	close(enabled_fd);
+	close(available_fd);
+}
+
+/**
+ * rollback_vhosts - Restore the state saved by snapshot_vhosts, only touching
+ * files, symbolic links and hosts entries that differ from the snapshot
+ */
+void rollback_vhosts(const char *snapshot_path) {
+	char available_path[PATH_MAX]; // 4096
+	char enabled_path[PATH_MAX]; // 4096
+	httpd_path(available_path, "sites-available");
+	httpd_path(enabled_path, "sites-enabled");
+	int available_fd = open_directory(AT_FDCWD, available_path);
+	int enabled_fd = open_directory(AT_FDCWD, enabled_path);
+	int snapshot_fd = open_directory(AT_FDCWD, snapshot_path);
+	int saved_fd = open_directory(snapshot_fd, "sites-available");
+	
+	// Read everything up front so a damaged snapshot changes nothing
+	struct vhost_list saved = {0};
+	read_vhosts(saved_fd, "sites-available", 0, &saved);
+	struct vhost_list saved_links = {0};
+	if(load_links(snapshot_fd, snapshot_path, "sites-enabled", &saved_links) == -1) {
+		fprintf(stderr, "apache2-vhost: cannot read snapshot `%s': %s\n", snapshot_path, strerror(errno));
+		exit(EX_DATAERR); // Exit 65
+	}
+	char parked_path[PATH_MAX]; // 4096
+	httpd_path(parked_path, "sites-parked");
+	struct vhost_list saved_parked = {0};
+	if(load_links(snapshot_fd, snapshot_path, "sites-parked", &saved_parked) == -1) {
+		fprintf(stderr, "apache2-vhost: cannot read snapshot `%s': %s\n", snapshot_path, strerror(errno));
+		exit(EX_DATAERR); // Exit 65
+	}
+	int parked_fd = openat(AT_FDCWD, parked_path, O_RDONLY | O_DIRECTORY);
+	size_t saved_hosts_len;
+	char *saved_hosts = read_file(snapshot_fd, "hosts", &saved_hosts_len);
+	if(saved_hosts == NULL) {
+		fprintf(stderr, "apache2-vhost: cannot read snapshot `%s': %s\n", snapshot_path, strerror(errno));
+		exit(EX_DATAERR); // Exit 65
+	}
+	// Configuration files: drop new ones, restore changed ones by rename
+	struct vhost_list available = {0};
+	read_vhosts(available_fd, available_path, 0, &available);
+	for(size_t i = 0; i < available.count; i++) {
+		if(vhost_list_find(&saved, available.entries[i].name) == NULL && unlinkat(available_fd, available.entries[i].name, 0) == -1) {
+			fprintf(stderr, "apache2-vhost: failed to remove regular file `%s/%s': %s\n", available_path, available.entries[i].name, strerror(errno));
+			exit(EX_SOFTWARE); // Exit 70
+		}
+	}
+	for(size_t i = 0; i < saved.count; i++) {
+		const char *name = saved.entries[i].name;
+		const struct vhost_entry *current = vhost_list_find(&available, name);
+		if(current && S_ISREG(current->st.st_mode) && same_file(&saved.entries[i].st, &current->st)) {
+			continue;
+		}
+		unlinkat(available_fd, rollback_name, 0);
+		if(clone_file(saved_fd, name, available_fd, rollback_name) == -1 || renameat(available_fd, rollback_name, available_fd, name) == -1) {
+			fprintf(stderr, "apache2-vhost: cannot restore regular file `%s/%s': %s\n", available_path, name, strerror(errno));
+			exit(EX_CANTCREAT); // Exit 73
+		}
+	}
+	
+	// Symbolic links, enabled and parked: drop, re-point or recreate
+	restore_links(enabled_fd, enabled_path, &saved_links);
+	if(parked_fd == -1 && saved_parked.count > 0) {
+		if(mkdir(parked_path, 0755) == -1 && errno != EEXIST) {
+			fprintf(stderr, "apache2-vhost: cannot create directory `%s': %s\n", parked_path, strerror(errno));
+			exit(EX_CANTCREAT); // Exit 73
+		}
+		parked_fd = open_directory(AT_FDCWD, parked_path);
+	}
+	if(parked_fd != -1) {
+		restore_links(parked_fd, parked_path, &saved_parked);
+		close(parked_fd);
+	}
+	
+	/**
+	 * Hosts entries: any --link line for a vhost known to either side is
+	 * managed. Keep the ones the snapshot has in place, drop the rest, append
+	 * the missing ones, and only rewrite the file if that changed anything.
+	 */
+	struct vhost_list saved_entries = {0};
+	for(char *line = saved_hosts; *line;) {
+		char *line_end = strchr(line, '\n');
+		if(line_end) {
+			*line_end = '\0';
+		}
+		size_t host_len;
+		const char *host = hosts_entry(line, strlen(line), &host_len);
+		if(host) {
+			vhost_list_add(&saved_entries, host, NULL, NULL);
+		}
+		line = line_end ? line_end + 1 : &line[strlen(line)];
+	}
+	qsort(saved_entries.entries, saved_entries.count, sizeof *saved_entries.entries, vhost_entry_cmp);
+	
+	size_t hosts_len;
+	char *hosts = read_file(AT_FDCWD, "/etc/hosts", &hosts_len);
+	if(hosts == NULL) {
+		fprintf(stderr, "apache2-vhost: cannot open regular file `%s' for reading: %s\n", "/etc/hosts", strerror(errno));
+		exit(EX_SOFTWARE); // Exit 70
+	}
+	char *restored = NULL;
+	size_t restored_len = 0;
+	FILE *restored_stream = open_memstream(&restored, &restored_len);
+	if(restored_stream == NULL) {
+		fprintf(stderr, "apache2-vhost: out of memory: %s\n", strerror(errno));
+		exit(EX_OSERR); // Exit 71
+	}
+	for(char *line = hosts; line < &hosts[hosts_len];) {
+		char *line_end = strchr(line, '\n');
+		size_t line_len = line_end ? (size_t)(line_end - line) : strlen(line);
+		size_t host_len;
+		const char *host = hosts_entry(line, line_len, &host_len);
+		if(host && (vhost_list_find_host(&saved, host, host_len) || vhost_list_find_host(&available, host, host_len))) {
+			char host_name[NAME_MAX + 1];
+			snprintf(host_name, sizeof host_name, "%.*s", (int)host_len, host);
+			struct vhost_entry *entry = vhost_list_find(&saved_entries, host_name);
+			if(entry == NULL || entry->target != NULL) {
+				// Not in the snapshot, or a duplicate of a line already kept
+				line += line_len + 1;
+				continue;
+			}
+			// Mark the entry as kept so it is not appended again
+			entry->target = entry->name;
+		}
+		fwrite(line, 1, line_len, restored_stream);
+		if(line_end) {
+			fputc('\n', restored_stream);
+		}
+		line += line_len + 1;
+	}
+	for(size_t i = 0; i < saved_entries.count; i++) {
+		if(saved_entries.entries[i].target == NULL) {
+			fflush(restored_stream);
+			if(restored_len > 0 && restored[restored_len - 1] != '\n') {
+				fputc('\n', restored_stream);
+			}
+			fprintf(restored_stream, "127.0.0.1\t%s\n", saved_entries.entries[i].name);
+		}
+	}
+	fclose(restored_stream);
+	if(restored_len != hosts_len || memcmp(restored, hosts, hosts_len) != 0) {
+		// Rewritten in place, /etc/hosts is often a mount point
+		FILE *hosts_file = fopen("/etc/hosts", "w");
+		if(hosts_file == NULL) {
+			fprintf(stderr, "apache2-vhost: cannot open regular file `%s' for writing: %s\n", "/etc/hosts", strerror(errno));
+			exit(EX_SOFTWARE); // Exit 70
+		}
+		fwrite(restored, 1, restored_len, hosts_file);
+		if(fclose(hosts_file) != 0) {
+			fprintf(stderr, "apache2-vhost: cannot write regular file `%s': %s\n", "/etc/hosts", strerror(errno));
+			exit(EX_IOERR); // Exit 74
+		}
+	}
+	free(restored);
+	free(hosts);
+	free(saved_hosts);
+	refresh_traffic_conf();
+	
+	close(saved_fd);
+	close(snapshot_fd);
+	close(enabled_fd);
+	close(available_fd);
+}
+
+/**
+ * Per-vhost totals gathered from the access logs: the number of requests and
+ * the time of the most recent one (0 if none).
+ */
+struct vhost_traffic {
+	unsigned long long hits;
+	time_t last;
+};
+
+/**
+ * Open addressing hash of the ServerNames of a vhost_list, so each log line
+ * costs one lookup however many vhosts there are. slots hold index + 1.
+ */
+struct traffic_index {
+	const struct vhost_list *vhosts;
+	size_t *slots;
+	size_t mask;
+};
+
+/**
+ * hash_host - FNV-1a hash of the first len bytes of host
+ */
+size_t hash_host(const char *host, size_t len) {
+	size_t hash = 2166136261u;
+	for(size_t i = 0; i < len; i++) {
+		hash = (hash ^ (unsigned char)host[i]) * 16777619u;
+	}
+	return hash;
+}
+
+/**
+ * traffic_index_build - Hash every vhost in vhosts by its ServerName, which is
+ * its file name without file_extension
+ */
+void traffic_index_build(struct traffic_index *index, const struct vhost_list *vhosts) {
+	size_t ext_len = strlen(file_extension);
+	size_t size = 16;
+	while(size < vhosts->count * 2) {
+		size *= 2;
+	}
+	index->vhosts = vhosts;
+	index->mask = size - 1;
+	index->slots = calloc(size, sizeof *index->slots);
+	if(index->slots == NULL) {
+		fprintf(stderr, "apache2-vhost: out of memory: %s\n", strerror(errno));
+		exit(EX_OSERR); // Exit 71
+	}
+	for(size_t i = 0; i < vhosts->count; i++) {
+		const char *name = vhosts->entries[i].name;
+		size_t slot = hash_host(name, strlen(name) - ext_len) & index->mask;
+		while(index->slots[slot] != 0) {
+			slot = (slot + 1) & index->mask;
+		}
+		index->slots[slot] = i + 1;
+	}
+}
+
+/**
+ * traffic_index_find - Return the vhosts index serving host, or -1
+ */
+long traffic_index_find(const struct traffic_index *index, const char *host, size_t len) {
+	size_t ext_len = strlen(file_extension);
+	size_t slot = hash_host(host, len) & index->mask;
+	while(index->slots[slot] != 0) {
+		const char *name = index->vhosts->entries[index->slots[slot] - 1].name;
+		if(strlen(name) - ext_len == len && memcmp(name, host, len) == 0) {
+			return index->slots[slot] - 1;
+		}
+		slot = (slot + 1) & index->mask;
+	}
+	return -1;
+}
+
+/**
+ * parse_log_time - Convert an Apache %t time, "10/Oct/2000:13:55:36 -0700",
+ * to seconds since the epoch. Returns -1 if s is not in that form.
+ */
+int parse_log_time(const char *s, time_t *t) {
+	static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+	// Consecutive lines nearly always share a second, so remember the last one
+	static char cached[26];
+	static time_t cached_time;
+	if(memcmp(s, cached, sizeof cached) == 0) {
+		*t = cached_time;
+		return 0;
+	}
+	for(int i = 0; i < 26; i++) {
+		if(s[i] == '\0' || s[i] == '\n') {
+			return -1;
+		}
+	}
+	if(s[2] != '/' || s[6] != '/' || s[11] != ':' || s[14] != ':' || s[17] != ':' || s[20] != ' ') {
+		return -1;
+	}
+	const char *month_name = NULL;
+	for(int i = 0; i < 12 && month_name == NULL; i++) {
+		if(memcmp(&s[3], &months[i * 3], 3) == 0) {
+			month_name = &months[i * 3];
+		}
+	}
+	if(month_name == NULL) {
+		return -1;
+	}
+	#define DIGITS2(p) (((p)[0] - '0') * 10 + ((p)[1] - '0'))
+	long day = DIGITS2(&s[0]);
+	long month = (month_name - months) / 3 + 1;
+	long year = DIGITS2(&s[7]) * 100 + DIGITS2(&s[9]);
+	long seconds = DIGITS2(&s[12]) * 3600L + DIGITS2(&s[15]) * 60L + DIGITS2(&s[18]);
+	long offset = (DIGITS2(&s[22]) * 60L + DIGITS2(&s[24])) * 60L;
+	#undef DIGITS2
+	if(s[21] == '-') {
+		offset = -offset;
+	}
+	// Days since 1970-01-01 in the proleptic Gregorian calendar
+	year -= month <= 2;
+	long era = (year >= 0 ? year : year - 399) / 400;
+	long year_of_era = year - era * 400;
+	long day_of_year = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+	long day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+	long days = era * 146097 + day_of_era - 719468;
+	*t = (time_t)days * 86400 + seconds - offset;
+	memcpy(cached, s, sizeof cached);
+	cached_time = *t;
+	return 0;
+}
+
+/**
+ * scan_log - Add up the requests in an access log read from fd. Only the
+ * vhost_combined format ("%v:%p %h %l %u %t ...") names the vhost, so lines
+ * whose first field is not a managed ServerName are skipped. first is lowered
+ * to the oldest time of a vhost_combined line, which lines counts.
+ */
+void scan_log(int fd, const struct traffic_index *index, struct vhost_traffic *traffic, time_t *first, unsigned long long *lines) {
+	static char buf[1 << 20]; // 1 MiB
+	size_t len = 0;
+	int skipping = 0;
+	for(;;) {
+		ssize_t n = read(fd, &buf[len], sizeof buf - len);
+		if(n == -1 && errno == EINTR) {
+			continue;
+		}
+		if(n <= 0) {
+			break;
+		}
+		len += n;
+		char *line = buf;
+		char *end = buf + len;
+		char *line_end;
+		while((line_end = memchr(line, '\n', end - line)) != NULL) {
+			if(skipping) {
+				// Tail of a line longer than buf, already given up on
+				skipping = 0;
+				line = line_end + 1;
+				continue;
+			}
+			char *host_end = line;
+			while(host_end < line_end && *host_end != ':' && *host_end != ' ') {
+				host_end++;
+			}
+			// Only a "%v:%p " first field makes this a vhost_combined line
+			char *port_end = host_end + 1;
+			while(port_end < line_end && *port_end >= '0' && *port_end <= '9') {
+				port_end++;
+			}
+			char *stamp = NULL;
+			if(host_end > line && *host_end == ':' && port_end > host_end + 1 && port_end < line_end && *port_end == ' ') {
+				stamp = memchr(port_end, '[', line_end - port_end);
+			}
+			time_t t;
+			if(stamp != NULL && line_end - stamp > 26 && parse_log_time(stamp + 1, &t) == 0) {
+				(*lines)++;
+				if(*first == 0 || t < *first) {
+					*first = t;
+				}
+				long i = traffic_index_find(index, line, host_end - line);
+				if(i != -1) {
+					traffic[i].hits++;
+					if(t > traffic[i].last) {
+						traffic[i].last = t;
+					}
+				}
+			}
+			line = line_end + 1;
+		}
+		// Keep the partial last line for the next read
+		len = end - line;
+		if(len == sizeof buf) {
+			skipping = 1;
+			len = 0;
+		} else {
+			memmove(buf, line, len);
+		}
+	}
+}
+
+/**
+ * scan_log_file - scan_log the file at path, through gzip -dc if it ends in
+ * .gz. Exits the (worker) process on failure.
+ */
+void scan_log_file(const char *path, const struct traffic_index *index, struct vhost_traffic *traffic, time_t *first, unsigned long long *lines) {
+	int fd = open(path, O_RDONLY);
+	if(fd == -1) {
+		fprintf(stderr, "apache2-vhost: cannot open regular file `%s' for reading: %s\n", path, strerror(errno));
+		exit(EX_NOINPUT); // Exit 66
+	}
+	if(!has_extension(path, ".gz")) {
+		scan_log(fd, index, traffic, first, lines);
+		close(fd);
+		return;
+	}
+	// Compressed (rotated) logs: let gzip inflate them in its own process
+	int gzip_pipe[2];
+	if(pipe(gzip_pipe) == -1) {
+		fprintf(stderr, "apache2-vhost: cannot create pipe: %s\n", strerror(errno));
+		exit(EX_OSERR); // Exit 71
+	}
+	pid_t gzip_pid = fork();
+	if(gzip_pid == -1) {
+		fprintf(stderr, "apache2-vhost: cannot fork: %s\n", strerror(errno));
+		exit(EX_OSERR); // Exit 71
+	}
+	if(gzip_pid == 0) {
+		dup2(fd, STDIN_FILENO);
+		dup2(gzip_pipe[1], STDOUT_FILENO);
+		close(fd);
+		close(gzip_pipe[0]);
+		close(gzip_pipe[1]);
+		execlp("gzip", "gzip", "-dc", (char *)NULL);
+		fprintf(stderr, "apache2-vhost: unable to locate gzip: %s\n", strerror(errno));
+		_exit(EX_UNAVAILABLE); // Exit 69
+	}
+	close(fd);
+	close(gzip_pipe[1]);
+	scan_log(gzip_pipe[0], index, traffic, first, lines);
+	close(gzip_pipe[0]);
+	int status;
+	if(waitpid(gzip_pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "apache2-vhost: cannot decompress `%s'\n", path);
+		exit(EX_DATAERR); // Exit 65
+	}
+}
+
+/**
+ * start_log_worker - Fork a process that scans the log at path and writes
+ * its per-vhost totals, oldest time and vhost_combined line count to the
+ * returned pipe
+ */
+pid_t start_log_worker(const char *path, const struct traffic_index *index, int *result_fd) {
+	int result_pipe[2];
+	if(pipe(result_pipe) == -1) {
+		fprintf(stderr, "apache2-vhost: cannot create pipe: %s\n", strerror(errno));
+		exit(EX_OSERR); // Exit 71
+	}
+	fflush(NULL);
+	pid_t pid = fork();
+	if(pid == -1) {
+		fprintf(stderr, "apache2-vhost: cannot fork: %s\n", strerror(errno));
+		exit(EX_OSERR); // Exit 71
+	}
+	if(pid == 0) {
+		close(result_pipe[0]);
+		size_t count = index->vhosts->count;
+		struct vhost_traffic *traffic = calloc(count + 1, sizeof *traffic);
+		if(traffic == NULL) {
+			fprintf(stderr, "apache2-vhost: out of memory: %s\n", strerror(errno));
+			_exit(EX_OSERR); // Exit 71
+		}
+		time_t first = 0;
+		unsigned long long lines = 0;
+		scan_log_file(path, index, traffic, &first, &lines);
+		// The oldest time and line count travel in the spare last slot
+		traffic[count].last = first;
+		traffic[count].hits = lines;
+		const char *out = (const char *)traffic;
+		size_t left = (count + 1) * sizeof *traffic;
+		while(left > 0) {
+			ssize_t n = write(result_pipe[1], out, left);
+			if(n == -1 && errno == EINTR) {
+				continue;
+			}
+			if(n <= 0) {
+				_exit(EX_IOERR); // Exit 74
+			}
+			out += n;
+			left -= n;
+		}
+		_exit(EXIT_SUCCESS); // Exit 0
+	}
+	close(result_pipe[1]);
+	*result_fd = result_pipe[0];
+	return pid;
+}
+
+/**
+ * finish_log_worker - Read a worker's totals into traffic, lowering first to
+ * its oldest time, and reap it. Returns the number of vhost_combined lines in
+ * the log; exits if the worker failed.
+ */
+unsigned long long finish_log_worker(pid_t pid, int result_fd, const char *path, size_t count, struct vhost_traffic *traffic, time_t *first) {
+	struct vhost_traffic *result = malloc((count + 1) * sizeof *result);
+	if(result == NULL) {
+		fprintf(stderr, "apache2-vhost: out of memory: %s\n", strerror(errno));
+		exit(EX_OSERR); // Exit 71
+	}
+	char *in = (char *)result;
+	size_t left = (count + 1) * sizeof *result;
+	while(left > 0) {
+		ssize_t n = read(result_fd, in, left);
+		if(n == -1 && errno == EINTR) {
+			continue;
+		}
+		if(n <= 0) {
+			break;
+		}
+		in += n;
+		left -= n;
+	}
+	close(result_fd);
+	int status;
+	if(waitpid(pid, &status, 0) == -1) {
+		fprintf(stderr, "apache2-vhost: failed to analyze access log `%s': %s\n", path, strerror(errno));
+		exit(EX_OSERR); // Exit 71
+	}
+	if(!WIFEXITED(status) || WEXITSTATUS(status) != 0 || left > 0) {
+		fprintf(stderr, "apache2-vhost: failed to analyze access log `%s'\n", path);
+		exit(WIFEXITED(status) && WEXITSTATUS(status) != 0 ? WEXITSTATUS(status) : EX_SOFTWARE);
+	}
+	for(size_t i = 0; i < count; i++) {
+		traffic[i].hits += result[i].hits;
+		if(result[i].last > traffic[i].last) {
+			traffic[i].last = result[i].last;
+		}
+	}
+	if(result[count].last != 0 && (*first == 0 || result[count].last < *first)) {
+		*first = result[count].last;
+	}
+	unsigned long long lines = result[count].hits;
+	free(result);
+	return lines;
+}
+
+/**
+ * Ordering of vhost indices by descending hits, then name, for qsort; the
+ * totals are reached through a file scope pointer as qsort takes no context.
+ */
+static const struct vhost_traffic *traffic_order_totals;
+static const struct vhost_list *traffic_order_vhosts;
+int traffic_order_cmp(const void *a, const void *b) {
+	size_t i = *(const size_t *)a;
+	size_t j = *(const size_t *)b;
+	if(traffic_order_totals[i].hits != traffic_order_totals[j].hits) {
+		return traffic_order_totals[i].hits < traffic_order_totals[j].hits ? 1 : -1;
+	}
+	return strcmp(traffic_order_vhosts->entries[i].name, traffic_order_vhosts->entries[j].name);
+}
+
+/**
+ * analyze_traffic - Count the requests per managed vhost in the access logs,
+ * one worker process per log, and print them busiest first. With park_days,
+ * unlink enabled vhosts idle for longer into HTTPD_ROOT/sites-parked/; with
+ * order_includes, write HTTPD_ROOT/apache2-vhost.traffic.conf including the
+ * enabled vhosts busiest first.
+ */
+void analyze_traffic(char **logs, int log_count, long park_days, int order_includes) {
+	char available_path[PATH_MAX]; // 4096
+	char enabled_path[PATH_MAX]; // 4096
+	httpd_path(available_path, "sites-available");
+	httpd_path(enabled_path, "sites-enabled");
+	int available_fd = open_directory(AT_FDCWD, available_path);
+	int enabled_fd = open_directory(AT_FDCWD, enabled_path);
+	
+	struct vhost_list available = {0};
+	read_vhosts(available_fd, available_path, 0, &available);
+	struct traffic_index index;
+	traffic_index_build(&index, &available);
+	struct vhost_traffic *traffic = calloc(available.count + 1, sizeof *traffic);
+	if(traffic == NULL) {
+		fprintf(stderr, "apache2-vhost: out of memory: %s\n", strerror(errno));
+		exit(EX_OSERR); // Exit 71
+	}
+	
+	// Keep one worker per processor busy, collecting whichever is done first
+	// and handing its slot to the next log
+	long workers = sysconf(_SC_NPROCESSORS_ONLN);
+	if(workers < 1) {
+		workers = 1;
+	}
+	if(workers > log_count) {
+		workers = log_count;
+	}
+	struct pollfd *result_fds = malloc(workers * sizeof *result_fds);
+	pid_t *pids = malloc(workers * sizeof *pids);
+	int *slot_logs = malloc(workers * sizeof *slot_logs);
+	if(result_fds == NULL || pids == NULL || slot_logs == NULL) {
+		fprintf(stderr, "apache2-vhost: out of memory: %s\n", strerror(errno));
+		exit(EX_OSERR); // Exit 71
+	}
+	time_t first = 0;
+	const char *unnamed_log = NULL;
+	int started = 0;
+	int running = 0;
+	while(started < log_count || running > 0) {
+		while(started < log_count && running < workers) {
+			pids[running] = start_log_worker(logs[started], &index, &result_fds[running].fd);
+			result_fds[running].events = POLLIN;
+			result_fds[running].revents = 0;
+			slot_logs[running] = started;
+			started++;
+			running++;
+		}
+		if(poll(result_fds, running, -1) == -1) {
+			if(errno == EINTR) {
+				continue;
+			}
+			fprintf(stderr, "apache2-vhost: cannot wait for access log workers: %s\n", strerror(errno));
+			exit(EX_OSERR); // Exit 71
+		}
+		// Workers write only once done, so a ready pipe reads straight through
+		for(int slot = 0; slot < running; slot++) {
+			if(result_fds[slot].revents == 0) {
+				continue;
+			}
+			const char *log = logs[slot_logs[slot]];
+			if(finish_log_worker(pids[slot], result_fds[slot].fd, log, available.count, traffic, &first) == 0 && unnamed_log == NULL) {
+				unnamed_log = log;
+			}
+			running--;
+			result_fds[slot] = result_fds[running];
+			pids[slot] = pids[running];
+			slot_logs[slot] = slot_logs[running];
+			slot--;
+		}
+	}
+	free(slot_logs);
+	free(pids);
+	free(result_fds);
+	
+	size_t *order = malloc((available.count + 1) * sizeof *order);
+	if(order == NULL) {
+		fprintf(stderr, "apache2-vhost: out of memory: %s\n", strerror(errno));
+		exit(EX_OSERR); // Exit 71
+	}
+	for(size_t i = 0; i < available.count; i++) {
+		order[i] = i;
+	}
+	traffic_order_totals = traffic;
+	traffic_order_vhosts = &available;
+	qsort(order, available.count, sizeof *order, traffic_order_cmp);
+	size_t ext_len = strlen(file_extension);
+	for(size_t i = 0; i < available.count; i++) {
+		const char *name = available.entries[order[i]].name;
+		char last_seen[11] = "-";
+		if(traffic[order[i]].last != 0) {
+			struct tm tm;
+			strftime(last_seen, sizeof last_seen, "%Y-%m-%d", localtime_r(&traffic[order[i]].last, &tm));
+		}
+		printf("%12llu  %-10s  %.*s\n", traffic[order[i]].hits, last_seen, (int)(strlen(name) - ext_len), name);
+	}
+	
+	struct vhost_list enabled = {0};
+	read_vhosts(enabled_fd, enabled_path, 1, &enabled);
+	unsigned long long total_hits = 0;
+	for(size_t i = 0; i < available.count; i++) {
+		total_hits += traffic[i].hits;
+	}
+	if(park_days > 0) {
+		// No hits is only evidence of idleness if the logs are the right ones
+		// and go back far enough
+		time_t cutoff = time(NULL) - (time_t)park_days * 86400;
+		if(unnamed_log != NULL) {
+			fprintf(stderr, "apache2-vhost: access log `%s' has no vhost_combined lines, not parking any vhost\n", unnamed_log);
+		} else if(total_hits == 0) {
+			fprintf(stderr, "apache2-vhost: access logs have no requests for any vhost, not parking any vhost\n");
+		} else if(first == 0 || first > cutoff) {
+			fprintf(stderr, "apache2-vhost: access logs do not cover the last %ld days, not parking any vhost\n", park_days);
+		} else {
+			char parked_path[PATH_MAX]; // 4096
+			httpd_path(parked_path, "sites-parked");
+			if(mkdir(parked_path, 0755) == -1 && errno != EEXIST) {
+				fprintf(stderr, "apache2-vhost: cannot create directory `%s': %s\n", parked_path, strerror(errno));
+				exit(EX_CANTCREAT); // Exit 73
+			}
+			int parked_fd = open_directory(AT_FDCWD, parked_path);
+			for(size_t i = 0; i < enabled.count; i++) {
+				struct vhost_entry *entry = vhost_list_find(&available, enabled.entries[i].name);
+				if(entry == NULL) {
+					continue;
+				}
+				// Idle: no request since the cutoff, and not created, edited,
+				// linked or unparked since (renaming the link changes its ctime)
+				if(traffic[entry - available.entries].last < cutoff && entry->st.st_mtime < cutoff && enabled.entries[i].st.st_ctime < cutoff) {
+					if(renameat(enabled_fd, entry->name, parked_fd, entry->name) == -1) {
+						fprintf(stderr, "apache2-vhost: failed to park symbolic link `%s/%s': %s\n", enabled_path, entry->name, strerror(errno));
+						exit(EX_SOFTWARE); // Exit 70
+					}
+					enabled.entries[i].target = NULL;
+				}
+			}
+			close(parked_fd);
+		}
+	}
+	if(order_includes) {
+		char *conf = NULL;
+		size_t conf_len = 0;
+		FILE *conf_stream = open_memstream(&conf, &conf_len);
+		if(conf_stream == NULL) {
+			fprintf(stderr, "apache2-vhost: out of memory: %s\n", strerror(errno));
+			exit(EX_OSERR); // Exit 71
+		}
+		fprintf(conf_stream, "# Generated by apache2-vhost --analyze-traffic --order-includes, busiest first\n");
+		// Other sites first, in glob order, so the default vhost stays the same
+		struct dirent **sites;
+		int site_count = scandir(enabled_path, &sites, other_site, alphasort);
+		for(int i = 0; i < site_count; i++) {
+			fprintf(conf_stream, "Include %s/%s\n", enabled_path, sites[i]->d_name);
+			free(sites[i]);
+		}
+		if(site_count != -1) {
+			free(sites);
+		}
+		for(size_t i = 0; i < available.count; i++) {
+			struct vhost_entry *entry = vhost_list_find(&enabled, available.entries[order[i]].name);
+			if(entry != NULL && entry->target != NULL) {
+				fprintf(conf_stream, "Include %s/%s\n", enabled_path, entry->name);
+			}
+		}
+		fclose(conf_stream);
+		write_traffic_conf(conf, conf_len);
+		free(conf);
+	} else {
+		refresh_traffic_conf();
+	}
+	free(order);
+	free(traffic);
+	free(index.slots);
+	close(enabled_fd);
+	close(available_fd);
+}
+
+/**
+ * unpark_vhost - Move a vhost parked by --park-idle back to sites-enabled/
+ */
+void unpark_vhost(const char *vhost) {
+	char vhost_name[NAME_MAX]; // 255
+	int vhost_fnlen = snprintf(vhost_name, sizeof vhost_name, "%s%s", vhost, file_extension);
+	// Check to make sure the filename is not too long
+	if(vhost_fnlen == -1 || vhost_fnlen >= NAME_MAX) {
+		fprintf(stderr, "apache2-vhost: file name `%s'too long: %s\n", vhost_name, strerror(errno));
+		exit(EX_SOFTWARE); // Exit 70
+	}
+	char parked_path[PATH_MAX]; // 4096
+	char enabled_path[PATH_MAX]; // 4096
+	httpd_path(parked_path, "sites-parked");
+	httpd_path(enabled_path, "sites-enabled");
+	int parked_fd = open_directory(AT_FDCWD, parked_path);
+	int enabled_fd = open_directory(AT_FDCWD, enabled_path);
+	if(renameat(parked_fd, vhost_name, enabled_fd, vhost_name) == -1) {
+		fprintf(stderr, "apache2-vhost: failed to unpark symbolic link `%s/%s': %s\n", parked_path, vhost_name, strerror(errno));
+		exit(EX_SOFTWARE); // Exit 70
+	}
+	close(enabled_fd);
+	close(parked_fd);
+	refresh_traffic_conf();
+}
+
 int main(int argc, char *argv[]) {
 	/* Attempt to find HTTPD_ROOT from apache2 -V */
 	FILE *apache_pipe;
@@ -157,8 +1525,12 @@ int main(int argc, char *argv[]) {
 	/* Process our options and act accordingly */
 	int c = 0;
 	int option_index = 0;
+	// --analyze-traffic modifiers, acted upon once all options are read
+	char *traffic_log = NULL;
+	long park_days = 0;
+	int order_includes = 0;
 	while(c != -1) {
-		c = getopt_long(argc, argv, "a:hlp:r:s:v", long_opts, &option_index);
+		c = getopt_long(argc, argv, "a:hi:lop:r:R:s:S:t:u:v", long_opts, &option_index);
 		switch(c) {
 			case 'a':
 				if(optarg) {
@@ -234,6 +1606,7 @@ int main(int argc, char *argv[]) {
 						fprintf(stderr, "apache2-vhost: failed to create symbolic link `%s': %s\n", vhost_symlinkpath, strerror(errno));
 						exit(EX_SOFTWARE); // Exit 70
 					}
+					refresh_traffic_conf();
 					
 					// Open up /etc/hosts for adding the entry
 					FILE *hosts_file = fopen("/etc/hosts", "r+");
@@ -269,7 +1642,7 @@ int main(int argc, char *argv[]) {
 			case 'h':
 				printf(usage);
 				printf("\n");
-				printf(extended_help, file_extension);
+				printf(extended_help, file_extension, file_extension);
 				exit(EXIT_SUCCESS); // Exit 0
 				break;
 			case 'l':
@@ -337,11 +1710,28 @@ int main(int argc, char *argv[]) {
 						exit(EX_SOFTWARE); // Exit 70
 					}
 					
+					// Put together the path it has if --park-idle parked it
+					char vhost_parkedpath[PATH_MAX]; // 4096
+					int vhost_parklen = snprintf(vhost_parkedpath, sizeof vhost_parkedpath, "%s/sites-parked/%s", httpd_root, vhost_name);
+					// Check to make sure the parked path is not too long
+					if(vhost_parklen == -1 || vhost_parklen >= PATH_MAX) {
+						fprintf(stderr, "apache2-vhost: file path `%s' too long: %s\n", vhost_parkedpath, strerror(errno));
+						exit(EX_SOFTWARE); // Exit 70
+					}
+					
+					// The link is in one of the two, either will do
 					int vhost_unsymlink = unlink(vhost_symlinkpath);
-					if(vhost_unsymlink != 0) {
-						fprintf(stderr, "apache2-vhost: failed to remove symbolic link `%s': %s\n", vhost_symlinkpath, strerror(errno));
+					int vhost_symerrno = errno;
+					int vhost_unparklink = unlink(vhost_parkedpath);
+					if(vhost_unparklink != 0 && errno != ENOENT) {
+						fprintf(stderr, "apache2-vhost: failed to remove symbolic link `%s': %s\n", vhost_parkedpath, strerror(errno));
 						exit(EX_SOFTWARE); // Exit 70
 					}
+					if(vhost_unsymlink != 0 && (vhost_symerrno != ENOENT || vhost_unparklink != 0)) {
+						fprintf(stderr, "apache2-vhost: failed to remove symbolic link `%s': %s\n", vhost_symlinkpath, strerror(vhost_symerrno));
+						exit(EX_SOFTWARE); // Exit 70
+					}
+					refresh_traffic_conf();
 					// TODO: Remove from /etc/hosts
 					exit(EXIT_SUCCESS); // Exit 0
 				} else {
@@ -349,6 +1739,75 @@ int main(int argc, char *argv[]) {
 					exit(EX_USAGE); // Exit 64
 				}
 				break;
+			case 'R':
+				if(optarg) {
+					rollback_vhosts(optarg);
+					exit(EXIT_SUCCESS); // Exit 0
+				} else {
+					fprintf(stderr, usage);
+					exit(EX_USAGE); // Exit 64
+				}
+				break;
+			case 'S':
+				if(optarg) {
+					snapshot_vhosts(optarg);
+					exit(EXIT_SUCCESS); // Exit 0
+				} else {
+					fprintf(stderr, usage);
+					exit(EX_USAGE); // Exit 64
+				}
+				break;
+			case 'i':
+				if(optarg) {
+					char *days_end;
+					park_days = strtol(optarg, &days_end, 10);
+					// Capped at a century, well clear of time_t overflow
+					if(*days_end != '\0' || park_days <= 0 || park_days > 36500) {
+						fprintf(stderr, "apache2-vhost: invalid number of days `%s'\n", optarg);
+						exit(EX_USAGE); // Exit 64
+					}
+				} else {
+					fprintf(stderr, usage);
+					exit(EX_USAGE); // Exit 64
+				}
+				break;
+			case 'o':
+				order_includes = 1;
+				break;
+			case 't':
+				if(optarg) {
+					traffic_log = optarg;
+				} else {
+					fprintf(stderr, usage);
+					exit(EX_USAGE); // Exit 64
+				}
+				break;
+			case 'u':
+				if(optarg) {
+					unpark_vhost(optarg);
+					exit(EXIT_SUCCESS); // Exit 0
+				} else {
+					fprintf(stderr, usage);
+					exit(EX_USAGE); // Exit 64
+				}
+				break;
+			case -1:
+				if(traffic_log) {
+					// Any further arguments are more (rotated) access logs
+					int log_count = argc - optind + 1;
+					char **logs = malloc(log_count * sizeof *logs);
+					if(logs == NULL) {
+						fprintf(stderr, "apache2-vhost: out of memory: %s\n", strerror(errno));
+						exit(EX_OSERR); // Exit 71
+					}
+					logs[0] = traffic_log;
+					memcpy(&logs[1], &argv[optind], (log_count - 1) * sizeof *logs);
+					analyze_traffic(logs, log_count, park_days, order_includes);
+					exit(EXIT_SUCCESS); // Exit 0
+				}
+				fprintf(stderr, usage);
+				exit(EX_USAGE); // Exit 64
+				break;
 			case 'v':
 				printf(v_info, VERSION, AUTHOR);
 				exit(EXIT_SUCCESS); // Exit 0